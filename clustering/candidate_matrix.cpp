@@ -0,0 +1,216 @@
+// candidate_matrix.cpp
+
+#include "candidate_matrix.h"
+
+#include <assert.h>
+
+#include <vector>
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define CANDIDATE_MATRIX_X86
+#include <immintrin.h>
+#endif
+
+// rows are padded to a whole number of AVX2 registers
+static const int LANES = 16;
+
+
+// Padding and picked organisms have nearest == 0, so they add nothing.
+
+static int gainScalar( const unsigned short *dist,
+		       const unsigned short *nearest,
+		       const unsigned short *weight, int length )
+{
+  int value = 0;
+  for ( int j = 0; j < length; j++ )
+    if ( nearest[j] > dist[j] )
+      value += weight[j] * ( nearest[j] - dist[j] );
+  return value;
+}
+
+static void pickScalar( unsigned short *nearest, const unsigned short *dist,
+			int length )
+{
+  for ( int j = 0; j < length; j++ )
+    if ( nearest[j] > dist[j] )
+      nearest[j] = dist[j];
+}
+
+#ifdef CANDIDATE_MATRIX_X86
+
+// subs_epu16 gives max( 0, nearest - dist ), madd_epi16 multiplies by
+// the weights and adds neighbouring products into 32 bit lanes. Both
+// factors are at most MAX_VALUE, so nothing overflows.
+
+__attribute__(( target( "avx2" ) ))
+static int gainAVX2( const unsigned short *dist, const unsigned short *nearest,
+		     const unsigned short *weight, int length )
+{
+  __m256i sum = _mm256_setzero_si256();
+  for ( int j = 0; j < length; j += 16 ){
+    __m256i d = _mm256_loadu_si256( (const __m256i*)( dist + j ) );
+    __m256i n = _mm256_loadu_si256( (const __m256i*)( nearest + j ) );
+    __m256i w = _mm256_loadu_si256( (const __m256i*)( weight + j ) );
+    sum = _mm256_add_epi32( sum, _mm256_madd_epi16( _mm256_subs_epu16( n, d ),
+						    w ) );
+  }
+  __m128i s = _mm_add_epi32( _mm256_castsi256_si128( sum ),
+			     _mm256_extracti128_si256( sum, 1 ) );
+  s = _mm_add_epi32( s, _mm_shuffle_epi32( s, 0x4e ) );
+  s = _mm_add_epi32( s, _mm_shuffle_epi32( s, 0xb1 ) );
+  return _mm_cvtsi128_si32( s );
+}
+
+__attribute__(( target( "avx2" ) ))
+static void pickAVX2( unsigned short *nearest, const unsigned short *dist,
+		      int length )
+{
+  for ( int j = 0; j < length; j += 16 ){
+    __m256i d = _mm256_loadu_si256( (const __m256i*)( dist + j ) );
+    __m256i n = _mm256_loadu_si256( (const __m256i*)( nearest + j ) );
+    _mm256_storeu_si256( (__m256i*)( nearest + j ), _mm256_min_epu16( n, d ) );
+  }
+}
+
+__attribute__(( target( "sse2" ) ))
+static int gainSSE2( const unsigned short *dist, const unsigned short *nearest,
+		     const unsigned short *weight, int length )
+{
+  __m128i sum = _mm_setzero_si128();
+  for ( int j = 0; j < length; j += 8 ){
+    __m128i d = _mm_loadu_si128( (const __m128i*)( dist + j ) );
+    __m128i n = _mm_loadu_si128( (const __m128i*)( nearest + j ) );
+    __m128i w = _mm_loadu_si128( (const __m128i*)( weight + j ) );
+    sum = _mm_add_epi32( sum, _mm_madd_epi16( _mm_subs_epu16( n, d ), w ) );
+  }
+  sum = _mm_add_epi32( sum, _mm_shuffle_epi32( sum, 0x4e ) );
+  sum = _mm_add_epi32( sum, _mm_shuffle_epi32( sum, 0xb1 ) );
+  return _mm_cvtsi128_si32( sum );
+}
+
+// SSE2 has no unsigned 16 bit minimum: min( n, d ) = n - max( 0, n - d )
+__attribute__(( target( "sse2" ) ))
+static void pickSSE2( unsigned short *nearest, const unsigned short *dist,
+		      int length )
+{
+  for ( int j = 0; j < length; j += 8 ){
+    __m128i d = _mm_loadu_si128( (const __m128i*)( dist + j ) );
+    __m128i n = _mm_loadu_si128( (const __m128i*)( nearest + j ) );
+    _mm_storeu_si128( (__m128i*)( nearest + j ),
+		      _mm_sub_epi16( n, _mm_subs_epu16( n, d ) ) );
+  }
+}
+
+static bool haveAVX2()
+{
+  static const bool avx2 = __builtin_cpu_supports( "avx2" );
+  return avx2;
+}
+
+static bool haveSSE2()
+{
+  static const bool sse2 = __builtin_cpu_supports( "sse2" );
+  return sse2;
+}
+
+#endif
+
+
+CandidateMatrix::CandidateMatrix() : m_size( 0 ), m_stride( 0 )
+{
+}
+
+void CandidateMatrix::build( const vector<vector<int> > &matrix,
+			     const vector<int> &weight,
+			     const vector<int> &candidates, int numCandidates,
+			     const vector<int> &nearest )
+{
+  m_size = numCandidates;
+  m_stride = ( numCandidates + LANES - 1 ) / LANES * LANES;
+  m_dist.assign( static_cast<size_t>( m_size ) * m_stride, 0 );
+  m_nearest.assign( m_stride, 0 );
+  m_weight.assign( m_stride, 0 );
+  m_posOf.assign( matrix.size(), -1 );
+  m_orgAt.assign( candidates.begin(), candidates.begin() + numCandidates );
+
+  for ( int a = 0; a < m_size; a++ ){
+    m_posOf[m_orgAt[a]] = a;
+    assert( nearest[m_orgAt[a]] <= MAX_VALUE );
+    m_nearest[a] = nearest[m_orgAt[a]];
+    assert( weight[m_orgAt[a]] <= MAX_VALUE );
+    m_weight[a] = weight[m_orgAt[a]];
+
+    const vector<int> &row = matrix[m_orgAt[a]];
+    unsigned short *dist = &m_dist[static_cast<size_t>( a ) * m_stride];
+    for ( int b = 0; b < m_size; b++ ){
+      assert( row[m_orgAt[b]] <= MAX_VALUE );
+      dist[b] = row[m_orgAt[b]];
+    }
+  }
+}
+
+void CandidateMatrix::compact( const vector<int> &candidates, int numCandidates )
+{
+  int stride = ( numCandidates + LANES - 1 ) / LANES * LANES;
+  vector<unsigned short> dist( static_cast<size_t>( numCandidates ) * stride, 0 );
+  vector<unsigned short> nearest( stride, 0 );
+  vector<unsigned short> weight( stride, 0 );
+  vector<int> oldPos( numCandidates );
+
+  for ( int a = 0; a < numCandidates; a++ )
+    oldPos[a] = m_posOf[candidates[a]];
+
+  for ( int a = 0; a < numCandidates; a++ ){
+    nearest[a] = m_nearest[oldPos[a]];
+    weight[a] = m_weight[oldPos[a]];
+    const unsigned short *oldRow =
+      &m_dist[static_cast<size_t>( oldPos[a] ) * m_stride];
+    for ( int b = 0; b < numCandidates; b++ )
+      dist[static_cast<size_t>( a ) * stride + b] = oldRow[oldPos[b]];
+  }
+
+  for ( int a = 0; a < m_size; a++ )
+    m_posOf[m_orgAt[a]] = -1;
+  m_orgAt.assign( candidates.begin(), candidates.begin() + numCandidates );
+  for ( int a = 0; a < numCandidates; a++ )
+    m_posOf[m_orgAt[a]] = a;
+
+  m_size = numCandidates;
+  m_stride = stride;
+  m_dist.swap( dist );
+  m_nearest.swap( nearest );
+  m_weight.swap( weight );
+}
+
+int CandidateMatrix::gain( int org ) const
+{
+  if ( m_size == 0 )
+    return 0;
+
+  assert( m_posOf[org] >= 0 );
+  const unsigned short *dist = &m_dist[static_cast<size_t>( m_posOf[org] ) * m_stride];
+#ifdef CANDIDATE_MATRIX_X86
+  if ( haveAVX2() )
+    return gainAVX2( dist, &m_nearest[0], &m_weight[0], m_stride );
+  if ( haveSSE2() )
+    return gainSSE2( dist, &m_nearest[0], &m_weight[0], m_stride );
+#endif
+  return gainScalar( dist, &m_nearest[0], &m_weight[0], m_stride );
+}
+
+void CandidateMatrix::pick( int org )
+{
+  assert( m_posOf[org] >= 0 );
+  const unsigned short *dist = &m_dist[static_cast<size_t>( m_posOf[org] ) * m_stride];
+#ifdef CANDIDATE_MATRIX_X86
+  if ( haveAVX2() ){
+    pickAVX2( &m_nearest[0], dist, m_stride );
+    return;
+  }
+  if ( haveSSE2() ){
+    pickSSE2( &m_nearest[0], dist, m_stride );
+    return;
+  }
+#endif
+  pickScalar( &m_nearest[0], dist, m_stride );
+}
@@ -0,0 +1,69 @@
+#ifndef CANDIDATE_MATRIX_H
+#define CANDIDATE_MATRIX_H
+
+#include <assert.h>
+
+#include <vector>
+
+using namespace std;
+
+/**
+ * Compact 16 bit copy of the distances between the organisms that have
+ * not been picked yet, together with their distance to the nearest pick
+ * and their weight. Rows are contiguous and padded, so the gain of a
+ * candidate is a straight SIMD loop (AVX2 or SSE2, chosen at run time,
+ * with a plain C++ fallback).
+ **/
+class CandidateMatrix {
+private:
+  int m_size;                    // organisms in the layout
+  int m_stride;                  // row length including padding
+  vector<unsigned short> m_dist;
+  vector<unsigned short> m_nearest;
+  vector<unsigned short> m_weight;
+  vector<int> m_posOf;           // position of each organism, or -1
+  vector<int> m_orgAt;
+
+  CandidateMatrix( const CandidateMatrix & );
+  const CandidateMatrix & operator=( const CandidateMatrix & );
+public:
+  CandidateMatrix();
+
+  /**
+   * The 16 bit layout holds if no distance and no weight exceeds this.
+   **/
+  static const int MAX_VALUE = 32767;
+
+  /**
+   * Lays out the first numCandidates organisms of candidates, with their
+   * current distances to the nearest pick.
+   **/
+  void build( const vector<vector<int> > &matrix, const vector<int> &weight,
+	      const vector<int> &candidates, int numCandidates,
+	      const vector<int> &nearest );
+
+  /**
+   * Drops everything but the first numCandidates organisms of candidates
+   * from the layout, keeping their distances to the nearest pick.
+   **/
+  void compact( const vector<int> &candidates, int numCandidates );
+
+  /**
+   * sum over all j of weight[j] * max( 0, nearest[j] - dist[org][j] )
+   **/
+  int gain( int org ) const;
+
+  /**
+   * Lowers the distances to the nearest pick after picking org.
+   **/
+  void pick( int org );
+
+  int getNearest( int org ) const {
+    assert( m_posOf[org] >= 0 );
+    return m_nearest[m_posOf[org]]; }
+
+  int size() const {
+    return m_size; }
+};
+
+#endif
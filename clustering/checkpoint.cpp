@@ -0,0 +1,148 @@
+// checkpoint.cpp
+
+#include "checkpoint.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// byte offset of row i in the rows file of an n x n matrix
+static long rowOffset( int n, int i )
+{
+  return static_cast<long>( sizeof( int ) ) *
+    ( static_cast<long>( i ) * n - static_cast<long>( i ) * ( i - 1 ) / 2 );
+}
+
+static void readList( istream &in, vector<int> &list, int size )
+{
+  list.resize( size );
+  for ( int i = 0; i < size; i++ )
+    in >> list[i];
+}
+
+static void writeList( FILE *out, const vector<int> &list )
+{
+  for ( unsigned int i = 0; i < list.size(); i++ )
+    fprintf( out, i + 1 < list.size() ? "%d " : "%d", list[i] );
+  fprintf( out, "\n" );
+}
+
+bool readCheckpoint( const string &fileName, CheckpointState &state )
+{
+  ifstream in( fileName.c_str() );
+  if ( in.fail() )
+    return false;
+
+  string dummy;
+  int dedup, clustering, finished, numPicks, numNonPicked;
+  in >> dummy >> dummy
+     >> dummy >> state.m_numOrganisms >> state.m_firstId >> state.m_lastId
+     >> dummy >> state.m_metric >> state.m_cutoff >> dedup >> state.m_cacheRows
+     >> dummy >> state.m_rows
+     >> dummy >> state.m_distanceSum
+     >> dummy >> state.m_maxDistance
+     >> dummy >> clustering >> finished
+     >> dummy >> numPicks >> state.m_numPicked;
+  state.m_dedup = dedup != 0;
+  state.m_clustering = clustering != 0;
+  state.m_finished = finished != 0;
+
+  state.m_pickOrgs.resize( numPicks );
+  state.m_pickValues.resize( numPicks );
+  for ( int k = 0; k < numPicks; k++ )
+    in >> state.m_pickOrgs[k] >> state.m_pickValues[k];
+
+  in >> dummy >> numNonPicked;
+  readList( in, state.m_nonPicked, numNonPicked );
+  in >> dummy;
+  readList( in, state.m_nearest, state.m_clustering ? state.m_numOrganisms : 0 );
+
+  if ( in.fail() ){
+    cerr << "checkpoint " << fileName << " is damaged. Exiting" << endl;
+    exit( -1 );
+  }
+  return true;
+}
+
+void writeCheckpoint( const string &fileName, const CheckpointState &state )
+{
+  string tmpFile = fileName + ".tmp";
+  FILE *out = fopen( tmpFile.c_str(), "w" );
+  if ( out == 0 ){
+    cerr << "cannot open checkpoint file " << tmpFile << endl;
+    exit( -1 );
+  }
+
+  fprintf( out, "#treeCS checkpoint\n" );
+  fprintf( out, "organisms %d %d %d\n", state.m_numOrganisms,
+	   state.m_firstId, state.m_lastId );
+  fprintf( out, "run %d %d %d %d\n", state.m_metric, state.m_cutoff,
+	   state.m_dedup ? 1 : 0, state.m_cacheRows );
+  fprintf( out, "rows %d\n", state.m_rows );
+  fprintf( out, "sum %.17g\n", state.m_distanceSum );
+  fprintf( out, "max %d\n", state.m_maxDistance );
+  fprintf( out, "clustering %d %d\n", state.m_clustering ? 1 : 0,
+	   state.m_finished ? 1 : 0 );
+  fprintf( out, "picks %d %d\n", static_cast<int>( state.m_pickOrgs.size() ),
+	   state.m_numPicked );
+  for ( unsigned int k = 0; k < state.m_pickOrgs.size(); k++ )
+    fprintf( out, "%d %d\n", state.m_pickOrgs[k], state.m_pickValues[k] );
+  fprintf( out, "nonpicked %d\n", static_cast<int>( state.m_nonPicked.size() ) );
+  writeList( out, state.m_nonPicked );
+  fprintf( out, "nearest\n" );
+  writeList( out, state.m_nearest );
+
+  if ( fflush( out ) != 0 || fsync( fileno( out ) ) != 0 || fclose( out ) != 0 ||
+       rename( tmpFile.c_str(), fileName.c_str() ) != 0 ){
+    cerr << "cannot write checkpoint file " << fileName << endl;
+    exit( -1 );
+  }
+}
+
+void saveDistanceRows( const string &fileName,
+		       const vector<vector<int> > &matrix,
+		       int firstRow, int lastRow )
+{
+  int n = matrix.size();
+
+  FILE *out = fopen( fileName.c_str(), firstRow == 0 ? "wb" : "r+b" );
+  if ( out == 0 || fseek( out, rowOffset( n, firstRow ), SEEK_SET ) != 0 ){
+    cerr << "cannot open checkpoint file " << fileName << endl;
+    exit( -1 );
+  }
+
+  for ( int i = firstRow; i < lastRow; i++ )
+    fwrite( &matrix[i][i], sizeof( int ), n - i, out );
+
+  if ( ferror( out ) || fflush( out ) != 0 || fsync( fileno( out ) ) != 0 ||
+       fclose( out ) != 0 ){
+    cerr << "cannot write checkpoint file " << fileName << endl;
+    exit( -1 );
+  }
+}
+
+bool loadDistanceRows( const string &fileName, vector<vector<int> > &matrix,
+		       int numRows )
+{
+  int n = matrix.size();
+
+  FILE *in = fopen( fileName.c_str(), "rb" );
+  if ( in == 0 )
+    return false;
+
+  bool ok = true;
+  for ( int i = 0; i < numRows && ok; i++ ){
+    ok = fread( &matrix[i][i], sizeof( int ), n - i, in )
+      == static_cast<size_t>( n - i );
+    for ( int j = i + 1; j < n; j++ )
+      matrix[j][i] = matrix[i][j];
+  }
+  fclose( in );
+
+  return ok;
+}
@@ -0,0 +1,69 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Progress of a run, as far as it is needed to continue it. The rows of
+ * the distance matrix themselves are kept in a separate file.
+ **/
+struct CheckpointState {
+  int m_numOrganisms;       // to recognise the run
+  int m_firstId;
+  int m_lastId;
+  int m_metric;             // and the options it was started with
+  int m_cutoff;
+  bool m_dedup;
+  int m_cacheRows;
+
+  int m_rows;               // finished rows of the distance matrix
+  double m_distanceSum;     // running sums of the matrix fill
+  int m_maxDistance;
+
+  bool m_clustering;        // the clustering state below is valid
+  bool m_finished;          // no more picks to make
+  vector<int> m_pickOrgs;   // every pick written to the output
+  vector<int> m_pickValues;
+  int m_numPicked;          // how many of them are in m_picked
+  vector<int> m_nonPicked;
+  vector<int> m_nearest;    // nearestDistToPicked
+
+  CheckpointState() :
+    m_numOrganisms( 0 ), m_firstId( 0 ), m_lastId( 0 ), m_metric( 0 ),
+    m_cutoff( 0 ), m_dedup( false ), m_cacheRows( 0 ), m_rows( 0 ),
+    m_distanceSum( 0 ), m_maxDistance( 0 ), m_clustering( false ),
+    m_finished( false ), m_numPicked( 0 ) {}
+};
+
+/**
+ * Reads a checkpoint. Returns false if there is none.
+ **/
+bool readCheckpoint( const string &fileName, CheckpointState &state );
+
+/**
+ * Writes the checkpoint to a temporary file, flushes it to disk and
+ * renames it over the old one, so a crash leaves either the old or the
+ * new checkpoint.
+ **/
+void writeCheckpoint( const string &fileName, const CheckpointState &state );
+
+/**
+ * Writes rows [firstRow, lastRow) of the upper triangle of the matrix to
+ * their place in the rows file and flushes them to disk. Anything after
+ * them from an earlier, interrupted run is overwritten later.
+ **/
+void saveDistanceRows( const string &fileName,
+		       const vector<vector<int> > &matrix,
+		       int firstRow, int lastRow );
+
+/**
+ * Reads rows [0, numRows) back into the (already sized) matrix, filling
+ * both triangles.
+ **/
+bool loadDistanceRows( const string &fileName, vector<vector<int> > &matrix,
+		       int numRows );
+
+#endif
@@ -51,7 +51,7 @@ void Genebank::removeGenotype( Genotype *g )
 
 Genotype* Genebank::createGenotype( int id, int parentId, int
 				    treeDepth, int birth, int
-				    death, string genes )
+				    death, const string &genes )
 {
   Genotype *g = new Genotype( 0, parentId, treeDepth, id, birth,
 			      death, genes );
@@ -28,7 +28,7 @@ public:
    * does not need to be added.
    **/
   Genotype* createGenotype( int id, int parentId, int treeDepth, int
-			      birth, int death, string genes );
+			      birth, int death, const string &genes );
   
   /**
    * Sets up the correct parent pointers.
@@ -16,6 +16,7 @@ private:
   int m_count;
   bool m_coalescent;
   mutable bool m_tagged;
+  mutable int m_index;
   string m_genes;
   
   Genotype();
@@ -23,10 +24,11 @@ private:
   const Genotype & operator=( const Genotype &g );
 public:
   Genotype( Genotype* parent, int parentId, int treeDepth, int id,
-	    int birth, int death, string genes ) :
+	    int birth, int death, const string &genes ) :
     m_parent( parent ), m_parentId( parentId ), m_treeDepth( treeDepth ), 
     m_id( id ), m_birth( birth ), m_death( death ), m_count( 0 ),
-    m_coalescent( false ), m_tagged( false ), m_genes ( genes ) {}
+    m_coalescent( false ), m_tagged( false ), m_index( -1 ),
+    m_genes ( genes ) {}
 
   void incrementCount() {
     m_count += 1; }
@@ -48,6 +50,13 @@ public:
   void setTagged( bool c = true ) const {
     m_tagged = c; }
 
+  /**
+   * Scratch slot for algorithms that number the genotypes of a subtree.
+   * Must be reset to -1 afterwards.
+   **/
+  void setIndex( int i ) const {
+    m_index = i; }
+
   int getParentId() const {
     return m_parentId; }
   
@@ -63,6 +72,9 @@ public:
   int getDeath() const {
     return m_death; }
   
+  const string & getGenes() const {
+    return m_genes; }
+
   char getGene( int pos ) const {
     return m_genes[pos]; }
 
@@ -77,6 +89,9 @@ public:
 
   bool isTagged() const {
     return m_tagged; }
+
+  int getIndex() const {
+    return m_index; }
 };
 
 #endif
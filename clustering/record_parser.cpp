@@ -0,0 +1,158 @@
+// record_parser.cpp
+
+#include "record_parser.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+// positions of the fields we use in a detail / historic line
+static const int ID_FIELD = 0;
+static const int PARENT_FIELD = 3;
+static const int BIRTH_FIELD = 11;
+static const int DEATH_FIELD = 12;
+static const int DEPTH_FIELD = 13;
+static const int GENOME_FIELD = 16;
+static const int MAX_FIELDS = 20;
+
+static const size_t BATCH_SIZE = 4096;
+
+
+MappedFile::MappedFile() : m_data( 0 ), m_size( 0 )
+{
+}
+
+MappedFile::~MappedFile()
+{
+  if ( m_size > 0 )
+    munmap( const_cast<char*>( m_data ), m_size );
+}
+
+bool MappedFile::open( const char *fileName )
+{
+  int fd = ::open( fileName, O_RDONLY );
+  if ( fd < 0 )
+    return false;
+
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 ){
+    close( fd );
+    return false;
+  }
+
+  m_size = st.st_size;
+  if ( m_size > 0 ){
+    void *data = mmap( 0, m_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( data == MAP_FAILED ){
+      m_size = 0;
+      close( fd );
+      return false;
+    }
+    madvise( data, m_size, MADV_SEQUENTIAL );
+    m_data = static_cast<const char*>( data );
+  }
+  close( fd );
+
+  return true;
+}
+
+
+vector<const char*> splitAtLines( const char *begin, const char *end,
+				  int numChunks )
+{
+  vector<const char*> bounds;
+  bounds.push_back( begin );
+  for ( int c = 1; c < numChunks; c++ ){
+    const char *p = begin + ( end - begin ) * c / numChunks;
+    if ( p < bounds.back() )
+      p = bounds.back();
+    // move to the start of the next line
+    while ( p > begin && p < end && p[-1] != '\n' )
+      p++;
+    bounds.push_back( p );
+  }
+  bounds.push_back( end );
+
+  return bounds;
+}
+
+
+static bool parseInt( const char *begin, const char *end, int &value )
+{
+  char *stop;
+  long v = strtol( begin, &stop, 10 );
+  if ( stop != end )
+    return false;
+  value = static_cast<int>( v );
+  return true;
+}
+
+void parseRecords( const char *begin, const char *end, int numFields,
+		   bool keepGenes, RecordBatchQueue *queue )
+{
+  const char *fieldBegin[MAX_FIELDS];
+  const char *fieldEnd[MAX_FIELDS];
+
+  RecordBatch *batch = new RecordBatch;
+  batch->reserve( BATCH_SIZE );
+
+  const char *p = begin;
+  while ( p < end ){
+    const char *eol = static_cast<const char*>( memchr( p, '\n', end - p ) );
+    if ( eol == 0 )
+      eol = end;
+
+    // split the line into whitespace separated fields
+    int n = 0;
+    const char *q = p;
+    while ( n < numFields ){
+      while ( q < eol && ( *q == ' ' || *q == '\t' || *q == '\r' ) )
+	q++;
+      if ( q == eol )
+	break;
+      fieldBegin[n] = q;
+      while ( q < eol && *q != ' ' && *q != '\t' && *q != '\r' )
+	q++;
+      fieldEnd[n] = q;
+      n++;
+    }
+
+    GenotypeRecord r;
+    if ( n == numFields && *p != '#' &&
+	 parseInt( fieldBegin[ID_FIELD], fieldEnd[ID_FIELD], r.m_id ) &&
+	 parseInt( fieldBegin[BIRTH_FIELD], fieldEnd[BIRTH_FIELD], r.m_birth ) &&
+	 parseInt( fieldBegin[DEATH_FIELD], fieldEnd[DEATH_FIELD], r.m_death ) &&
+	 parseInt( fieldBegin[DEPTH_FIELD], fieldEnd[DEPTH_FIELD],
+		   r.m_treeDepth ) ){
+      if ( fieldEnd[PARENT_FIELD] - fieldBegin[PARENT_FIELD] == 6 &&
+	   strncmp( fieldBegin[PARENT_FIELD], "(none)", 6 ) == 0 )
+	r.m_parentId = 0;
+      else
+	r.m_parentId = atoi( fieldBegin[PARENT_FIELD] );
+
+      if ( keepGenes )
+	r.m_genes.assign( fieldBegin[GENOME_FIELD], fieldEnd[GENOME_FIELD] );
+
+      batch->push_back( r );
+      if ( batch->size() == BATCH_SIZE ){
+	queue->push( batch );
+	batch = new RecordBatch;
+	batch->reserve( BATCH_SIZE );
+      }
+    }
+
+    p = eol + 1;
+  }
+
+  if ( batch->empty() )
+    delete batch;
+  else
+    queue->push( batch );
+  queue->close();
+}
@@ -0,0 +1,68 @@
+#ifndef RECORD_PARSER_H
+#define RECORD_PARSER_H
+
+#include "record_queue.h"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * The fields of one line of an avida detail or historic file that we use.
+ **/
+struct GenotypeRecord {
+  int m_id;
+  int m_parentId;
+  int m_treeDepth;
+  int m_birth;
+  int m_death;
+  string m_genes;
+};
+
+typedef vector<GenotypeRecord> RecordBatch;
+typedef RecordQueue<RecordBatch*> RecordBatchQueue;
+
+/**
+ * Read-only memory map of a whole input file.
+ **/
+class MappedFile {
+private:
+  const char *m_data;
+  size_t m_size;
+
+  MappedFile( const MappedFile & );
+  const MappedFile & operator=( const MappedFile & );
+public:
+  MappedFile();
+  ~MappedFile();
+
+  bool open( const char *fileName );
+
+  const char *begin() const {
+    return m_data; }
+
+  const char *end() const {
+    return m_data + m_size; }
+
+  size_t size() const {
+    return m_size; }
+};
+
+/**
+ * Splits [begin, end) into numChunks pieces of about the same size that
+ * start and end at line boundaries. Returns numChunks+1 boundaries.
+ **/
+vector<const char*> splitAtLines( const char *begin, const char *end,
+				  int numChunks );
+
+/**
+ * Parses the lines in [begin, end) into batches and hands them to the
+ * queue, which is closed at the end. Lines need at least numFields
+ * fields; further fields are ignored. Comments, empty and malformed lines
+ * are skipped. The genome is only copied if keepGenes is set.
+ **/
+void parseRecords( const char *begin, const char *end, int numFields,
+		   bool keepGenes, RecordBatchQueue *queue );
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef RECORD_QUEUE_H
+#define RECORD_QUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Lets one consumer sleep until any of the queues it reads from has
+ * something new. Queues notify it on every push and on close; the lock
+ * is only taken while the consumer is asleep.
+ **/
+class QueueSignal {
+private:
+  mutex m_mutex;
+  condition_variable m_cond;
+  atomic<size_t> m_count;    // number of notifications so far
+  atomic<bool> m_sleeping;   // the consumer is in wait
+
+  QueueSignal( const QueueSignal & );
+  const QueueSignal & operator=( const QueueSignal & );
+public:
+  QueueSignal() : m_count( 0 ), m_sleeping( false ) {}
+
+  // Either notify sees m_sleeping set, or wait sees the new count: both
+  // sides store, then load the other's variable, all sequentially
+  // consistent.
+  void notify() {
+    m_count.fetch_add( 1 );
+    if ( !m_sleeping.load() )
+      return;
+    {
+      lock_guard<mutex> lock( m_mutex );
+    }
+    m_cond.notify_one();
+  }
+
+  /**
+   * Take this before looking at the queues, and pass it to wait if they
+   * were all empty.
+   **/
+  size_t count() const {
+    return m_count.load(); }
+
+  /**
+   * Returns once there was a notification after count() returned seen.
+   **/
+  void wait( size_t seen ) {
+    unique_lock<mutex> lock( m_mutex );
+    m_sleeping.store( true );
+    while ( m_count.load() == seen )
+      m_cond.wait( lock );
+    m_sleeping.store( false );
+  }
+};
+
+/**
+ * Bounded queue between exactly one producer thread and one consumer
+ * thread. Pushing and popping are lock-free; a producer facing a full
+ * queue sleeps until the consumer pops, and only then is a lock taken.
+ **/
+template <class T>
+class RecordQueue {
+private:
+  vector<T> m_slots;
+  atomic<size_t> m_head; // next slot to pop, written by the consumer
+  atomic<size_t> m_tail; // next slot to push, written by the producer
+  atomic<bool> m_closed;
+  atomic<bool> m_full;   // the producer sleeps until there is room
+  QueueSignal *m_ready;  // wakes the consumer
+  mutex m_mutex;
+  condition_variable m_notFull;
+
+  RecordQueue( const RecordQueue & );
+  const RecordQueue & operator=( const RecordQueue & );
+public:
+  RecordQueue( size_t capacity, QueueSignal *ready ) :
+    m_slots( capacity + 1 ), m_head( 0 ), m_tail( 0 ), m_closed( false ),
+    m_full( false ), m_ready( ready ) {}
+
+  bool tryPush( const T &item ) {
+    size_t tail = m_tail.load( memory_order_relaxed );
+    size_t next = ( tail + 1 ) % m_slots.size();
+    // sequentially consistent for the handshake with a sleeping push
+    if ( next == m_head.load() )
+      return false;
+    m_slots[tail] = item;
+    m_tail.store( next, memory_order_release );
+    m_ready->notify();
+    return true;
+  }
+
+  /**
+   * Sleeps while the queue is full.
+   **/
+  void push( const T &item ) {
+    if ( tryPush( item ) )
+      return;
+    unique_lock<mutex> lock( m_mutex );
+    m_full.store( true );
+    while ( !tryPush( item ) )
+      m_notFull.wait( lock );
+    m_full.store( false );
+  }
+
+  bool tryPop( T &item ) {
+    size_t head = m_head.load( memory_order_relaxed );
+    if ( head == m_tail.load( memory_order_acquire ) )
+      return false;
+    item = m_slots[head];
+    // same handshake as QueueSignal, with the producer asleep in push
+    m_head.store( ( head + 1 ) % m_slots.size() );
+    if ( m_full.load() ){
+      {
+	lock_guard<mutex> lock( m_mutex );
+      }
+      m_notFull.notify_one();
+    }
+    return true;
+  }
+
+  /**
+   * Called by the producer after its last push.
+   **/
+  void close() {
+    m_closed.store( true, memory_order_release );
+    m_ready->notify();
+  }
+
+  /**
+   * True once the producer is done and everything has been popped.
+   **/
+  bool isDrained() const {
+    return m_closed.load( memory_order_acquire ) &&
+      m_head.load( memory_order_relaxed ) == m_tail.load( memory_order_acquire );
+  }
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef ROW_CACHE_H
+#define ROW_CACHE_H
+
+#include <vector>
+
+using namespace std;
+
+/**
+ * Keeps the most recently used rows of a square matrix. Rows are owned
+ * by the cache; a pointer handed out stays valid until the row is
+ * evicted by a later insert.
+ **/
+class RowCache {
+private:
+  int m_rowLength;
+  vector<vector<int> > m_slots;
+  vector<int> m_slotOf;  // slot holding each row, or -1
+  vector<int> m_rowIn;   // row held by each slot, or -1
+  vector<int> m_prev;    // recency list over the slots
+  vector<int> m_next;
+  int m_first;           // most recently used slot
+  int m_last;            // least recently used slot
+
+  RowCache( const RowCache & );
+  const RowCache & operator=( const RowCache & );
+
+  void unlink( int s ) {
+    if ( m_prev[s] >= 0 )
+      m_next[m_prev[s]] = m_next[s];
+    else
+      m_first = m_next[s];
+    if ( m_next[s] >= 0 )
+      m_prev[m_next[s]] = m_prev[s];
+    else
+      m_last = m_prev[s];
+  }
+
+  void pushFront( int s ) {
+    m_prev[s] = -1;
+    m_next[s] = m_first;
+    if ( m_first >= 0 )
+      m_prev[m_first] = s;
+    else
+      m_last = s;
+    m_first = s;
+  }
+public:
+  RowCache( int numRows, int capacity ) :
+    m_rowLength( numRows ), m_slots( capacity ), m_slotOf( numRows, -1 ),
+    m_rowIn( capacity, -1 ), m_prev( capacity ), m_next( capacity ),
+    m_first( -1 ), m_last( -1 ) {
+    for ( int s = 0; s < capacity; s++ )
+      pushFront( s );
+  }
+
+  /**
+   * Returns the row and marks it as recently used, or 0 if it is not
+   * cached.
+   **/
+  int *find( int row ) {
+    int s = m_slotOf[row];
+    if ( s < 0 )
+      return 0;
+    unlink( s );
+    pushFront( s );
+    return &m_slots[s][0];
+  }
+
+  /**
+   * Evicts the least recently used row and returns the storage for the
+   * given row, which the caller has to fill.
+   **/
+  int *insert( int row ) {
+    int s = m_last;
+    if ( m_rowIn[s] >= 0 )
+      m_slotOf[m_rowIn[s]] = -1;
+    m_slots[s].resize( m_rowLength );
+    m_rowIn[s] = row;
+    m_slotOf[row] = s;
+    unlink( s );
+    pushFront( s );
+    return &m_slots[s][0];
+  }
+};
+
+#endif
@@ -2,46 +2,199 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+// name of the partial distance matrix file written by --shard
+static string shardFileName( const char *outputFile, int shard, int numShards )
+{
+  ostringstream name;
+  name << outputFile << ".shard" << shard << "of" << numShards;
+  return name.str();
+}
+
+static void usage()
+{
+  cout << "wrong number of arguments --\n";
+  cout << "format: treeCS [--metric tree|hamming|mrca] ";
+  cout << "[--linkage single|average] [--stats] [--dedup] [--shard <i>/<N>] ";
+  cout << "[--cache-rows <rows>] [--checkpoint <seconds>] [--resume] ";
+  cout << "[--threads <threads>] <gzipped detail file> <gzipped historic file> ";
+  cout << "<clustering data output file> ";
+  cout << "[<cluster cutoff value>]\n";
+  cout << "        treeCS --merge <N> [--linkage average] ";
+  cout << "[--checkpoint <seconds>] [--resume] ";
+  cout << "<clustering data output file> [<cluster cutoff value>]\n";
+}
 
 int main( int argc, char **argv )
 {
-  if ( argc < 4 ) {
-    cout << "wrong number of arguments --\n";
-    cout << "format: treeCS <gzipped detail file> <gzipped historic file> "; 
-    cout << "<clustering data output file> ";
-    cout << "[<cluster cutoff value>]\n";
+  // options come first, the remaining arguments are positional
+  string linkage;
+  string metric = "tree";
+  bool statsOnly = false;
+  bool dedup = false;
+  int shard = 0;
+  int numShards = 0;
+  int mergeShards = 0;
+  int cacheRows = 0;
+  int checkpointInterval = 0;
+  bool resume = false;
+  int numThreads = 0;
+  vector<char *> args;
+  args.push_back( argv[0] );
+  for ( int i = 1; i < argc; i++ ){
+    if ( strcmp( argv[i], "--linkage" ) == 0 && i + 1 < argc )
+      linkage = argv[++i];
+    else if ( strcmp( argv[i], "--metric" ) == 0 && i + 1 < argc )
+      metric = argv[++i];
+    else if ( strcmp( argv[i], "--stats" ) == 0 )
+      statsOnly = true;
+    else if ( strcmp( argv[i], "--dedup" ) == 0 )
+      dedup = true;
+    else if ( strcmp( argv[i], "--shard" ) == 0 && i + 1 < argc ){
+      if ( sscanf( argv[++i], "%d/%d", &shard, &numShards ) != 2 ||
+	   shard < 1 || shard > numShards ){
+	usage();
+	return 0;
+      }
+    }
+    else if ( strcmp( argv[i], "--merge" ) == 0 && i + 1 < argc )
+      mergeShards = atoi( argv[++i] );
+    else if ( strcmp( argv[i], "--cache-rows" ) == 0 && i + 1 < argc )
+      cacheRows = atoi( argv[++i] );
+    else if ( strcmp( argv[i], "--checkpoint" ) == 0 && i + 1 < argc )
+      checkpointInterval = atoi( argv[++i] );
+    else if ( strcmp( argv[i], "--resume" ) == 0 )
+      resume = true;
+    else if ( strcmp( argv[i], "--threads" ) == 0 && i + 1 < argc )
+      numThreads = atoi( argv[++i] );
+    else
+      args.push_back( argv[i] );
+  }
+
+  // the merge step only needs the output file and the cutoff
+  if ( mergeShards > 0 )
+    args.insert( args.begin() + 1, 2, (char *)0 );
+
+  if ( args.size() < 4 ||
+       ( !linkage.empty() && linkage != "single" && linkage != "average" ) ||
+       ( metric != "tree" && metric != "hamming" && metric != "mrca" ) ||
+       ( metric != "tree" && ( statsOnly || linkage == "single" ) ) ||
+       ( mergeShards > 0 && ( statsOnly || linkage == "single" ||
+			      numShards > 0 ) ) ||
+       ( dedup && ( metric != "hamming" || !linkage.empty() ) ) ||
+       ( cacheRows > 0 && ( metric != "tree" || numShards > 0 ||
+			    mergeShards > 0 ) ) ||
+       numThreads < 0 ) {
+    usage();
     return 0;
   }
   TreeAnalyzer t;
 
+  DistanceMetric m = TREE_DISTANCE;
+  if ( metric == "hamming" )
+    m = HAMMING_DISTANCE;
+  else if ( metric == "mrca" )
+    m = MRCA_DISTANCE;
+
+  int cutoff = 1;
+  if ( args.size() > 4 )
+    cutoff = atoi( args[4] );
+
+  string outputFile = args[3];
+  if ( numShards > 0 )
+    outputFile = shardFileName( args[3], shard, numShards );
+
+  // an output file with a checkpoint next to it is from an interrupted run
+  string checkpointFile = string( args[3] ) + ".checkpoint";
+  ifstream checkpoint( checkpointFile.c_str() );
+  bool interrupted = checkpoint.good() && numShards == 0 && !statsOnly;
+  checkpoint.close();
+  if ( resume && checkpointInterval <= 0 )
+    checkpointInterval = 600;
 
-  ifstream test( argv[3] );
-  if ( test.good() ){
-    cout << "cluster data file " << argv[3] << " exists already. ";
+  ifstream test( outputFile.c_str() );
+  if ( test.good() && !( resume && interrupted ) ){
+    cout << "cluster data file " << outputFile << " exists already. ";
     cout << "Skipping directory..." << endl;
+    if ( interrupted )
+      cout << "It has a checkpoint, use --resume to continue it." << endl;
 
     return 0;
   }
-  
+
   test.close();
-  
+
   for (int i = 0; i < argc; i++)
     cout << argv[i] << " ";
   cout << endl;
 
-  t.loadData( argv[1], argv[2] );
-  t.calculateDistanceMatrix();
-  // t.calculateMRCADistanceMatrix();
-  // t.calculateHammingDistanceMatrix();
-  if ( argc == 4 )
-    t.doClusteringAnalysis( argv[3] );
-  else
-    t.doClusteringAnalysis( argv[3], atoi( argv[4] ) );
+  if ( mergeShards > 0 ){
+    vector<string> shardFiles;
+    for ( int s = 1; s <= mergeShards; s++ )
+      shardFiles.push_back( shardFileName( args[3], s, mergeShards ) );
+    t.mergeDistanceMatrixShards( shardFiles );
+    if ( checkpointInterval > 0 )
+      t.enableCheckpoints( checkpointFile.c_str(), checkpointInterval, resume,
+			   m, cutoff, dedup, cacheRows );
+  }
+  else {
+    // only the Hamming distance looks at the genome sequences
+    t.loadData( args[1], args[2], metric == "hamming", numThreads );
+    if ( dedup )
+      t.dedupFinalPopulation();
+
+    // cheap screening run: only the distance statistics are written
+    if ( statsOnly ){
+      t.calculateDistanceStatistics();
+      t.writeDistanceStatistics( args[3] );
+      cout << "done!\n\n";
+      return 0;
+    }
+
+    // one slice of the matrix, to be assembled later with --merge
+    if ( numShards > 0 ){
+      t.calculateDistanceMatrixShard( outputFile.c_str(), shard, numShards, m );
+      cout << "done!\n\n";
+      return 0;
+    }
+
+    // single linkage streams its distances, so it does not need the matrix
+    if ( linkage == "single" ){
+      t.doSingleLinkageClustering();
+      t.writeDendrogram( ( string( args[3] ) + ".dendrogram" ).c_str() );
+    }
+
+    if ( checkpointInterval > 0 )
+      t.enableCheckpoints( checkpointFile.c_str(), checkpointInterval, resume,
+			   m, cutoff, dedup, cacheRows );
 
-  t.sortData( argv[3] );
+    if ( cacheRows > 0 )
+      t.useDistanceRows( cacheRows );
+    else if ( metric == "hamming" )
+      t.calculateHammingDistanceMatrix();
+    else if ( metric == "mrca" )
+      t.calculateMRCADistanceMatrix();
+    else
+      t.calculateDistanceMatrix();
+  }
+
+  t.doClusteringAnalysis( args[3], cutoff );
+
+  t.sortData( args[3] );
+
+  if ( linkage == "average" ){
+    t.doAverageLinkageClustering();
+    t.writeDendrogram( ( string( args[3] ) + ".dendrogram" ).c_str() );
+  }
+  t.removeCheckpoints();
   cout << "done!\n\n";
 
   return 0;
 }
-
@@ -1,109 +1,310 @@
 #include "tree_analyzer.h"
 
 #include "genebank.h"
+#include "candidate_matrix.h"
+#include "checkpoint.h"
 #include "genotype.h"
+#include "record_parser.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <fstream>
 #include <stdlib.h>
 #include <string> 
 #include <iomanip>
+#include <limits>
+#include <map>
+#include <set>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
 
 TreeAnalyzer::TreeAnalyzer() 
-  : m_maxTreeDepth( 0 ), m_aveDistance( 0 ), m_maxDistance( 0 )
+  : m_maxTreeDepth( 0 ), m_aveDistance( 0 ), m_maxDistance( 0 ),
+    m_genomesLoaded( false ), m_rowCache( 0 ), m_lazyMetric( TREE_DISTANCE ),
+    m_checkpointInterval( 0 ), m_lastCheckpoint( 0 )
 {
 }
 
 
 TreeAnalyzer::~TreeAnalyzer()
 {
+  delete m_rowCache;
 }
 
-void TreeAnalyzer::loadData( const char *detailFile, const char *historicFile )
+void TreeAnalyzer::loadData( const char *detailFile, const char *historicFile,
+			     bool loadGenomes, int numThreads )
 {
   cout << "loading data" << endl;
-  
-  ifstream final( detailFile );
-  if ( final.fail() ){
+
+  MappedFile final;
+  if ( !final.open( detailFile ) ){
     cerr << "error opening " << detailFile << ". Exiting" << endl;
     exit( -1 );
   }
-  
-  int id, parentId, treeDepth, birth, death, m_histPopSize;
-  string parentIdStr;
-  string dummy;
-  string genome; // new
-  m_finalPopSize = 0;
-  m_histPopSize = 0;
 
-  // Skip lines that start with a # - they are comments. Also skip empty lines
-  while (final.peek() == '#' || final.peek() == '\n')
-  {
-    final.ignore(1024, '\n'); 
+  MappedFile historic;
+  if ( !historic.open( historicFile ) ){
+    cerr << "error opening " << historicFile << ". Exiting" << endl;
+    exit( -1 );
   }
-  
-  // read in the data we are interested in
-  while ( final >> id    >> dummy  >> dummy >> parentIdStr  >> dummy 
-                >> dummy >> dummy  >> dummy >> dummy     >> dummy 
-                >> dummy >> birth  >> death >> treeDepth >> dummy 
-                >> dummy >> genome >> dummy >> dummy     >> dummy  ) {
-      // note: death = -1 for alive organisms
-    if ( treeDepth > m_maxTreeDepth )
-      m_maxTreeDepth = treeDepth;
-
-    if (parentIdStr.compare("(none)") == 0)
-        parentId = 0;
-    else
-        parentId = atoi(parentIdStr.c_str());
-
-    m_genebank.createGenotype( id, parentId, treeDepth, birth, death,
-			       genome );
-    m_finalPop.push_back( id );
-    m_finalPopSize += 1;
-  }
-  final.close();
 
-  cout << "final pop files opened ok: " << m_finalPopSize << " organisms found" << endl;
+  // One thread parses the detail file, which keeps the final population
+  // in file order. The historic file is split at line boundaries among
+  // the other threads. Up to numThreads files or pieces are parsed at
+  // the same time while this thread builds the genebank from the batches
+  // as they arrive, sleeping whenever there are none.
+  if ( numThreads <= 0 )
+    numThreads = max( 1, static_cast<int>( thread::hardware_concurrency() ) );
+  int numChunks = 1;
+  if ( historic.size() > 1024*1024 )
+    numChunks = max( 1, numThreads - 1 );
+  vector<const char*> bounds = splitAtLines( historic.begin(), historic.end(),
+					     numChunks );
 
-  ifstream historic( historicFile );
-  if ( historic.fail() ) {
-    cerr << "error opening " << historicFile << ". Exiting" << endl;
-    exit( -1 );
+  // genomes of the ancestors are never used. The number of fields changes
+  // in the historic file once the organisms start dying out - we only
+  // need the first 17.
+  vector<const char*> jobBegin( 1, final.begin() );
+  vector<const char*> jobEnd( 1, final.end() );
+  for ( int c = 0; c < numChunks; c++ ){
+    jobBegin.push_back( bounds[c] );
+    jobEnd.push_back( bounds[c + 1] );
   }
-  
-  // Skip lines that start with a # - they are comments. Also skip empty lines
-  while (historic.peek() == '#' || historic.peek() == '\n')
-  {
-    historic.ignore(1024, '\n'); 
-  }
-
-  while ( historic >> id    >> dummy  >> dummy >> parentIdStr  >> dummy 
-                >> dummy >> dummy  >> dummy >> dummy     >> dummy 
-                >> dummy >> birth  >> death >> treeDepth >> dummy 
-                >> dummy >> genome  ) {     
-
-    if (parentIdStr.compare("(none)") == 0)
-        parentId = 0;
-    else
-        parentId = atoi(parentIdStr.c_str());
-
-    m_genebank.createGenotype( id, parentId, treeDepth, birth, death,
-			       genome );
-    historic.ignore(1024, '\n'); // The number of fields changes in the historic file 
-                                 // once the organisms start dying out - we don't care 
-                                 // about those fields, but this is necessary to skip 
-                                 // them when they do exist.
-    m_histPopSize += 1;
-  }
-  historic.close();
-    
+
+  QueueSignal ready;
+  vector<RecordBatchQueue*> queues;
+  vector<thread> parsers;
+  for ( unsigned int q = 0; q < jobBegin.size(); q++ )
+    queues.push_back( new RecordBatchQueue( 8, &ready ) );
+
+  int m_histPopSize = 0;
+  m_finalPopSize = 0;
+  unsigned int numDrained = 0;
+  vector<bool> drained( queues.size(), false );
+  while ( numDrained < queues.size() ){
+    // keep numThreads parsers busy
+    while ( parsers.size() < queues.size() &&
+	    parsers.size() - numDrained < static_cast<unsigned int>( numThreads ) ){
+      int q = parsers.size();
+      parsers.push_back( thread( parseRecords, jobBegin[q], jobEnd[q],
+				 q == 0 ? 20 : 17, q == 0 && loadGenomes,
+				 queues[q] ) );
+    }
+
+    size_t seen = ready.count();
+    bool idle = true;
+    for ( unsigned int q = 0; q < parsers.size(); q++ ){
+      RecordBatch *batch;
+      if ( drained[q] )
+	continue;
+      if ( !queues[q]->tryPop( batch ) ){
+	if ( queues[q]->isDrained() ){
+	  drained[q] = true;
+	  numDrained += 1;
+	  idle = false;
+	}
+	continue;
+      }
+      idle = false;
+
+      for ( unsigned int k = 0; k < batch->size(); k++ ){
+	const GenotypeRecord &r = (*batch)[k];
+	m_genebank.createGenotype( r.m_id, r.m_parentId, r.m_treeDepth,
+				   r.m_birth, r.m_death, r.m_genes );
+	if ( q == 0 ){
+	  // note: death = -1 for alive organisms
+	  if ( r.m_treeDepth > m_maxTreeDepth )
+	    m_maxTreeDepth = r.m_treeDepth;
+	  m_finalPop.push_back( r.m_id );
+	  m_finalPopSize += 1;
+	}
+	else
+	  m_histPopSize += 1;
+      }
+      delete batch;
+    }
+    if ( idle )
+      ready.wait( seen );
+  }
+
+  for ( unsigned int q = 0; q < queues.size(); q++ ){
+    parsers[q].join();
+    delete queues[q];
+  }
+  m_genomesLoaded = loadGenomes;
+
+  cout << "final pop files opened ok: " << m_finalPopSize << " organisms found" << endl;
   cout << "historic files opened ok: " << m_histPopSize << " organisms found" << endl;
 
   m_genebank.setupParentPointers();
   //  Genotype *g = m_genebank.getGenotype( m_finalPop[0] );
   m_genebank.checkCoalescence( m_genebank.getGenotype( m_finalPop[0] ) );
   //m_genebank.print();
+
+  resetRepresentatives();
+}
+
+
+// every organism represents only itself
+void TreeAnalyzer::resetRepresentatives()
+{
+  m_weight.assign( m_finalPopSize, 1 );
+  m_expandedPop = m_finalPop;
+  m_expandedRep.resize( m_finalPopSize );
+  for ( int i = 0; i < m_finalPopSize; i++ )
+    m_expandedRep[i] = i;
+}
+
+
+// FNV-1a
+static unsigned long hashGenome( const string &genes )
+{
+  unsigned long h = 2166136261UL;
+  for ( unsigned int i = 0; i < genes.size(); i++ ){
+    h ^= static_cast<unsigned char>( genes[i] );
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+void TreeAnalyzer::dedupFinalPopulation()
+{
+  cout << "merging identical genomes" << endl;
+
+  if ( !m_genomesLoaded ){
+    cerr << "genomes were not loaded, cannot merge identical genomes" << endl;
+    exit( -1 );
+  }
+
+  // representatives by genome hash; collisions are resolved by comparing
+  multimap<unsigned long, int> byHash;
+  vector<int> reps;
+  vector<int> repOf( m_finalPopSize );
+  for ( int i = 0; i < m_finalPopSize; i++ ){
+    const string &genes = m_genebank.getGenotype( m_finalPop[i] )->getGenes();
+    unsigned long h = hashGenome( genes );
+
+    repOf[i] = -1;
+    multimap<unsigned long, int>::const_iterator it = byHash.lower_bound( h );
+    for ( ; it != byHash.end() && (*it).first == h; it++ ){
+      int r = reps[(*it).second];
+      if ( m_genebank.getGenotype( m_finalPop[r] )->getGenes() == genes ){
+	repOf[i] = (*it).second;
+	break;
+      }
+    }
+    if ( repOf[i] < 0 ){
+      repOf[i] = reps.size();
+      byHash.insert( make_pair( h, static_cast<int>( reps.size() ) ) );
+      reps.push_back( i );
+    }
+  }
+
+  vector<int> finalPop( reps.size() );
+  m_weight.assign( reps.size(), 0 );
+  for ( unsigned int r = 0; r < reps.size(); r++ )
+    finalPop[r] = m_finalPop[reps[r]];
+  for ( int i = 0; i < m_finalPopSize; i++ )
+    m_weight[repOf[i]] += 1;
+
+  m_expandedPop = m_finalPop;
+  m_expandedRep = repOf;
+  m_finalPop = finalPop;
+  m_finalPopSize = finalPop.size();
+
+  cout << m_expandedPop.size() << " organisms, " << m_finalPopSize
+       << " distinct genomes" << endl;
+}
+
+
+void TreeAnalyzer::enableCheckpoints( const char *checkpointFile,
+				      int interval, bool resume,
+				      DistanceMetric metric, int cutoff,
+				      bool dedup, int cacheRows )
+{
+  m_checkpointFile = checkpointFile;
+  m_checkpointInterval = interval;
+  m_lastCheckpoint = time( 0 );
+
+  int firstId = m_finalPopSize > 0 ? m_finalPop[0] : 0;
+  int lastId = m_finalPopSize > 0 ? m_finalPop[m_finalPopSize - 1] : 0;
+
+  if ( resume && readCheckpoint( m_checkpointFile, m_checkpoint ) ){
+    if ( m_checkpoint.m_numOrganisms != m_finalPopSize ||
+	 m_checkpoint.m_firstId != firstId || m_checkpoint.m_lastId != lastId ){
+      cerr << "checkpoint " << m_checkpointFile << " is from a different run."
+	   << " Exiting" << endl;
+      exit( -1 );
+    }
+    if ( m_checkpoint.m_metric != metric || m_checkpoint.m_cutoff != cutoff ||
+	 m_checkpoint.m_dedup != dedup || m_checkpoint.m_cacheRows != cacheRows ){
+      cerr << "checkpoint " << m_checkpointFile << " was written with a"
+	   << " different metric, cutoff, --dedup or --cache-rows. Exiting"
+	   << endl;
+      exit( -1 );
+    }
+    cout << "resuming from checkpoint: " << m_checkpoint.m_rows
+	 << " matrix rows, " << m_checkpoint.m_pickOrgs.size() << " picks" << endl;
+    return;
+  }
+
+  m_checkpoint = CheckpointState();
+  m_checkpoint.m_numOrganisms = m_finalPopSize;
+  m_checkpoint.m_firstId = firstId;
+  m_checkpoint.m_lastId = lastId;
+  m_checkpoint.m_metric = metric;
+  m_checkpoint.m_cutoff = cutoff;
+  m_checkpoint.m_dedup = dedup;
+  m_checkpoint.m_cacheRows = cacheRows;
+}
+
+void TreeAnalyzer::removeCheckpoints()
+{
+  if ( m_checkpointFile.empty() )
+    return;
+  unlink( m_checkpointFile.c_str() );
+  unlink( ( m_checkpointFile + ".rows" ).c_str() );
+}
+
+bool TreeAnalyzer::checkpointDue() const
+{
+  return !m_checkpointFile.empty() &&
+    time( 0 ) - m_lastCheckpoint >= m_checkpointInterval;
+}
+
+// the rows go first, so the checkpoint never refers to unwritten rows
+void TreeAnalyzer::saveDistanceCheckpoint( int rows )
+{
+  if ( m_checkpointFile.empty() )
+    return;
+
+  saveDistanceRows( m_checkpointFile + ".rows", m_distanceMatrix,
+		    m_checkpoint.m_rows, rows );
+  m_checkpoint.m_rows = rows;
+  m_checkpoint.m_distanceSum = m_aveDistance;
+  m_checkpoint.m_maxDistance = m_maxDistance;
+  writeCheckpoint( m_checkpointFile, m_checkpoint );
+  m_lastCheckpoint = time( 0 );
+}
+
+void TreeAnalyzer::saveClusteringCheckpoint( const vector<int> &nonPicked,
+					     int numNonPicked,
+					     const vector<int> &nearest,
+					     bool finished )
+{
+  if ( m_checkpointFile.empty() )
+    return;
+
+  m_checkpoint.m_clustering = true;
+  m_checkpoint.m_finished = finished;
+  m_checkpoint.m_numPicked = m_picked.size();
+  m_checkpoint.m_nonPicked.assign( nonPicked.begin(),
+				   nonPicked.begin() + numNonPicked );
+  m_checkpoint.m_nearest = nearest;
+  writeCheckpoint( m_checkpointFile, m_checkpoint );
+  m_lastCheckpoint = time( 0 );
 }
 
 
@@ -111,6 +312,31 @@ void TreeAnalyzer::calculateDistanceMatrix()
 {
   cout << "calculating distance matrix" << endl;
 
+  fillDistanceMatrix( TREE_DISTANCE );
+}
+
+
+void TreeAnalyzer::calculateHammingDistanceMatrix()
+{
+  cout << "calculating Hamming distance matrix" << endl;
+
+  if ( !m_genomesLoaded ){
+    cerr << "genomes were not loaded, cannot calculate Hamming distances" << endl;
+    exit( -1 );
+  }
+
+  fillDistanceMatrix( HAMMING_DISTANCE );
+}
+
+void TreeAnalyzer::calculateMRCADistanceMatrix()
+{
+  cout << "calculating depth to MRCA distance matrix" << endl;
+
+  fillDistanceMatrix( MRCA_DISTANCE );
+}
+
+void TreeAnalyzer::fillDistanceMatrix( DistanceMetric metric )
+{
   // Precompute stuff for time estimate
   int numCmps = (m_finalPopSize * (m_finalPopSize + 1)) / 2;
   int numCmpsCompleted = 0;
@@ -121,8 +347,24 @@ void TreeAnalyzer::calculateDistanceMatrix()
   m_distanceMatrix.resize( m_finalPopSize );
   for ( int i=0; i<m_finalPopSize; i++ )
     m_distanceMatrix[i].resize( m_finalPopSize );
+
+  // continue after the rows saved by an earlier run
+  int firstRow = 0;
+  if ( m_checkpoint.m_rows > 0 ){
+    if ( !loadDistanceRows( m_checkpointFile + ".rows", m_distanceMatrix,
+			    m_checkpoint.m_rows ) ){
+      cerr << "cannot read checkpoint file " << m_checkpointFile
+	   << ".rows. Exiting" << endl;
+      exit( -1 );
+    }
+    firstRow = m_checkpoint.m_rows;
+    m_aveDistance = m_checkpoint.m_distanceSum;
+    m_maxDistance = m_checkpoint.m_maxDistance;
+    numCmpsCompleted = (firstRow * (2*m_finalPopSize - firstRow + 1)) / 2;
+    cout << "resuming at row " << firstRow << endl;
+  }
     
-  for ( int i=0; i<m_finalPopSize; i++ ){
+  for ( int i=firstRow; i<m_finalPopSize; i++ ){
     cout << "\r";
     cout << "Progress: " << numCmpsCompleted << "/" << numCmps << " (" << setprecision(2) << (double)numCmpsCompleted/(double)numCmps*100.0 << "%)";
     cout.flush();
@@ -130,90 +372,233 @@ void TreeAnalyzer::calculateDistanceMatrix()
     //cout <<  "[" << i+1 << "/" << m_finalPopSize << "] ";
     //cout.flush();
     for ( int j=i; j<m_finalPopSize; j++ ){
-	int ID1 = m_finalPop[i];
-	int ID2 = m_finalPop[j];
-	int dist = m_genebank.calcTreeDist( m_genebank.getGenotype( ID1 ),
-					    m_genebank.getGenotype( ID2 ) );
+	int dist = calcDistance( metric, i, j );
+	if ( metric == MRCA_DISTANCE )
+	  assert(dist >= 0);
 	m_distanceMatrix[i][j] = dist;
 	m_distanceMatrix[j][i] = dist;
-	if ( i==j )
-	  m_aveDistance += dist;
+	if ( i==j ) {
+	  assert ( metric == TREE_DISTANCE || dist == 0 );
+	  m_aveDistance += static_cast<double>( dist )*m_weight[i]*m_weight[j];
+	}
 	else
-	  m_aveDistance += dist*2;
+	  m_aveDistance += 2.0*dist*m_weight[i]*m_weight[j];
 	
 	if ( dist > m_maxDistance )
 	  m_maxDistance = dist;
     }
     numCmpsCompleted += m_finalPopSize - i;
+
+    if ( i + 1 == m_finalPopSize || checkpointDue() )
+      saveDistanceCheckpoint( i + 1 );
   }
 
-  m_aveDistance /= static_cast<double>(m_finalPopSize*m_finalPopSize);
+  m_aveDistance /= static_cast<double>( m_expandedPop.size() )*m_expandedPop.size();
 }
 
+int TreeAnalyzer::calcDistance( DistanceMetric metric, int i, int j ) const
+{
+  const Genotype *g1 = m_genebank.getGenotype( m_finalPop[i] );
+  const Genotype *g2 = m_genebank.getGenotype( m_finalPop[j] );
 
-void TreeAnalyzer::calculateHammingDistanceMatrix()
+  switch ( metric ){
+  case HAMMING_DISTANCE:
+    return m_genebank.calcHammingDist( g1, g2 );
+  case MRCA_DISTANCE:
+    return m_genebank.calcMRCADist( g1, g2 );
+  default:
+    return m_genebank.calcTreeDist( g1, g2 );
+  }
+}
+
+void TreeAnalyzer::useDistanceRows( int cacheRows )
 {
-  cout << "calculating Hamming distance matrix" << endl;
-  
-  // reserve enough space
-  m_distanceMatrix.resize( m_finalPopSize );
-  for ( int i=0; i<m_finalPopSize; i++ )
-    m_distanceMatrix[i].resize( m_finalPopSize );
-  
-  for ( int i=0; i<m_finalPopSize; i++ ){
-    for ( int j=i; j<m_finalPopSize; j++ ){
-	int ID1 = m_finalPop[i];
-	int ID2 = m_finalPop[j];
-	int dist = m_genebank.calcHammingDist( m_genebank.getGenotype( ID1 ),
-					       m_genebank.getGenotype( ID2 ) );
-	m_distanceMatrix[i][j] = dist;
-	m_distanceMatrix[j][i] = dist;
-	if ( i==j ) {
-	  assert ( dist == 0 );
-	  m_aveDistance += dist;
-	}
-	else
-	  m_aveDistance += dist*2;
-	
-	if ( dist > m_maxDistance )
-	  m_maxDistance = dist;
-    }
+  cout << "computing distance rows on demand, caching " << cacheRows
+       << " rows" << endl;
+
+  calculateDistanceStatistics();
+
+  delete m_rowCache;
+  m_rowCache = new RowCache( m_finalPopSize, max( 1, cacheRows ) );
+  m_lazyMetric = TREE_DISTANCE;
+}
+
+const int *TreeAnalyzer::getDistanceRow( int i )
+{
+  if ( m_rowCache == 0 )
+    return &m_distanceMatrix[i][0];
+
+  int *row = m_rowCache->find( i );
+  if ( row != 0 )
+    return row;
+
+  row = m_rowCache->insert( i );
+  for ( int j = 0; j < m_finalPopSize; j++ )
+    row[j] = calcDistance( m_lazyMetric, i, j );
+  return row;
+}
+
+// first row of a shard, chosen so that every shard gets about the same
+// number of pairs (i,j), j>=i
+static int shardFirstRow( int n, int shard, int numShards )
+{
+  double total = 0.5 * n * ( n + 1.0 );
+  double target = total * ( shard - 1 ) / numShards;
+  int row = 0;
+  double pairs = 0;
+  while ( row < n && pairs < target ){
+    pairs += n - row;
+    row += 1;
   }
+  return row;
+}
+
+void TreeAnalyzer::calculateDistanceMatrixShard( const char *shardFile,
+						 int shard, int numShards,
+						 DistanceMetric metric )
+{
+  cout << "calculating distance matrix shard " << shard << "/" << numShards
+       << endl;
+
+  if ( metric == HAMMING_DISTANCE && !m_genomesLoaded ){
+    cerr << "genomes were not loaded, cannot calculate Hamming distances" << endl;
+    exit( -1 );
+  }
+
+  int firstRow = shardFirstRow( m_finalPopSize, shard, numShards );
+  int lastRow = shardFirstRow( m_finalPopSize, shard + 1, numShards );
+  cout << "rows " << firstRow << " to " << lastRow - 1 << endl;
 
-  m_aveDistance /= static_cast<double>(m_finalPopSize*m_finalPopSize);
+  ofstream out( shardFile );
+  if ( out.fail() ) {
+    cerr << "cannot open shard file " << shardFile << endl;
+    exit( -1 );
+  }
+
+  out << "#Shard: " << shard << " of " << numShards << endl;
+  out << "#Organisms: " << m_finalPopSize << endl;
+  out << "#Rows: " << firstRow << " " << lastRow << endl;
+  for ( int i = 0; i < m_finalPopSize; i++ )
+    out << m_finalPop[i] << ( i + 1 < m_finalPopSize ? " " : "\n" );
+  out << "#Population: " << m_expandedPop.size() << endl;
+  for ( unsigned int k = 0; k < m_expandedPop.size(); k++ )
+    out << m_expandedPop[k] << " " << m_expandedRep[k] << "\n";
+
+  // upper triangle only, row i starts at column i
+  for ( int i = firstRow; i < lastRow; i++ ){
+    for ( int j = i; j < m_finalPopSize; j++ )
+      out << calcDistance( metric, i, j )
+	  << ( j + 1 < m_finalPopSize ? " " : "\n" );
+  }
+
+  out.close();
 }
 
-void TreeAnalyzer::calculateMRCADistanceMatrix()
+void TreeAnalyzer::mergeDistanceMatrixShards( const vector<string> &shardFiles )
 {
-  cout << "calculating depth to MRCA distance matrix" << endl;
-  
-  // reserve enough space
-  m_distanceMatrix.resize( m_finalPopSize );
-  for ( int i=0; i<m_finalPopSize; i++ )
-    m_distanceMatrix[i].resize( m_finalPopSize );
-  
-  for ( int i=0; i<m_finalPopSize; i++ ){
-    for ( int j=i; j<m_finalPopSize; j++ ){
-	int ID1 = m_finalPop[i];
-	int ID2 = m_finalPop[j];
-	int dist = m_genebank.calcMRCADist( m_genebank.getGenotype( ID1 ),
-					    m_genebank.getGenotype( ID2 ) );
-	assert(dist >= 0);
+  cout << "merging " << shardFiles.size() << " distance matrix shards" << endl;
+
+  int nextRow = 0;
+  for ( unsigned int s = 0; s < shardFiles.size(); s++ ){
+    ifstream in( shardFiles[s].c_str() );
+    if ( in.fail() ){
+      cerr << "error opening " << shardFiles[s] << ". Exiting" << endl;
+      exit( -1 );
+    }
+
+    string dummy;
+    int shard, numShards, n, firstRow, lastRow;
+    in >> dummy >> shard >> dummy >> numShards >> dummy >> n
+       >> dummy >> firstRow >> lastRow;
+
+    if ( s == 0 ){
+      m_finalPopSize = n;
+      m_finalPop.resize( n );
+      m_distanceMatrix.resize( n );
+      for ( int i = 0; i < n; i++ )
+	m_distanceMatrix[i].resize( n );
+    }
+
+    if ( in.fail() || n != m_finalPopSize || firstRow != nextRow ){
+      cerr << "shard file " << shardFiles[s] << " does not continue at row "
+	   << nextRow << ". Exiting" << endl;
+      exit( -1 );
+    }
+
+    for ( int i = 0; i < n; i++ ){
+      int id;
+      in >> id;
+      if ( s > 0 && id != m_finalPop[i] ){
+	cerr << "shard file " << shardFiles[s] << " is from a different run."
+	     << " Exiting" << endl;
+	exit( -1 );
+      }
+      m_finalPop[i] = id;
+    }
+
+    int popSize;
+    in >> dummy >> popSize;
+    if ( s == 0 ){
+      m_expandedPop.resize( popSize );
+      m_expandedRep.resize( popSize );
+      m_weight.assign( n, 0 );
+    }
+    for ( int k = 0; k < popSize; k++ ){
+      int id, rep;
+      in >> id >> rep;
+      if ( s == 0 ){
+	m_expandedPop[k] = id;
+	m_expandedRep[k] = rep;
+	m_weight[rep] += 1;
+      }
+    }
+
+    for ( int i = firstRow; i < lastRow; i++ ){
+      for ( int j = i; j < n; j++ ){
+	int dist;
+	in >> dist;
 	m_distanceMatrix[i][j] = dist;
 	m_distanceMatrix[j][i] = dist;
-	if ( i==j ) {
-	  assert ( dist == 0 );
-	  m_aveDistance += dist;
-	}
+	if ( i==j )
+	  m_aveDistance += static_cast<double>( dist )*m_weight[i]*m_weight[j];
 	else
-	  m_aveDistance += dist*2;
-	
+	  m_aveDistance += 2.0*dist*m_weight[i]*m_weight[j];
+
 	if ( dist > m_maxDistance )
 	  m_maxDistance = dist;
+      }
+    }
+
+    if ( in.fail() ){
+      cerr << "shard file " << shardFiles[s] << " is truncated. Exiting" << endl;
+      exit( -1 );
     }
+    in.close();
+    nextRow = lastRow;
   }
 
-  m_aveDistance /= static_cast<double>(m_finalPopSize*m_finalPopSize);
+  if ( nextRow != m_finalPopSize ){
+    cerr << "shards end at row " << nextRow << " of " << m_finalPopSize
+	 << ". Exiting" << endl;
+    exit( -1 );
+  }
+
+  m_aveDistance /= static_cast<double>( m_expandedPop.size() )*m_expandedPop.size();
+}
+
+// drop in the weighted distances to the nearest pick if the organism
+// with the given row were picked next
+static int pickGain( const int *row, const vector<int> &nonPicked,
+		     int numNonPicked, const vector<int> &nearest,
+		     const vector<int> &weight )
+{
+  int value = 0;
+  for ( int j = 0; j < numNonPicked; j++ ){
+    int org = nonPicked[j];
+    if ( nearest[org] > row[org] )
+      value += weight[org] * ( nearest[org] - row[org] );
+  }
+  return value;
 }
 
 void TreeAnalyzer::doClusteringAnalysis( const char *clusterDataFile, int cutoff )
@@ -223,8 +608,8 @@ void TreeAnalyzer::doClusteringAnalysis( const char *clusterDataFile, int cutoff
   vector<int> nearestDistToPicked;
   vector<int> nonPickedGenotypes;
   
-  nearestDistToPicked.reserve( m_finalPopSize );
-  nonPickedGenotypes.reserve( m_finalPopSize );
+  nearestDistToPicked.resize( m_finalPopSize );
+  nonPickedGenotypes.resize( m_finalPopSize );
 
   // initialize values
   for ( int i = 0; i < m_finalPopSize; i++ ){
@@ -234,6 +619,57 @@ void TreeAnalyzer::doClusteringAnalysis( const char *clusterDataFile, int cutoff
   
   int maxNonPicked = m_finalPopSize - 1;
 
+  // pick up where an earlier run stopped
+  int firstPick = 0;
+  int pickOrg = 0;
+  if ( m_checkpoint.m_clustering ){
+    maxNonPicked = m_checkpoint.m_nonPicked.size() - 1;
+    copy( m_checkpoint.m_nonPicked.begin(), m_checkpoint.m_nonPicked.end(),
+	  nonPickedGenotypes.begin() );
+    nearestDistToPicked = m_checkpoint.m_nearest;
+    m_picked.assign( m_checkpoint.m_pickOrgs.begin(),
+		     m_checkpoint.m_pickOrgs.begin() + m_checkpoint.m_numPicked );
+    firstPick = m_checkpoint.m_pickOrgs.size();
+    if ( firstPick > 0 )
+      pickOrg = m_checkpoint.m_pickOrgs.back();
+  }
+  else {
+    m_checkpoint.m_pickOrgs.clear();
+    m_checkpoint.m_pickValues.clear();
+  }
+
+  // with the whole matrix in memory the gains are computed on a compact
+  // 16 bit copy of the candidates, if the values fit
+  int maxWeight = 0;
+  for ( int i = 0; i < m_finalPopSize; i++ )
+    maxWeight = max( maxWeight, m_weight[i] );
+  bool useCandidateMatrix = m_rowCache == 0 &&
+    2*m_maxDistance <= CandidateMatrix::MAX_VALUE &&
+    maxWeight <= CandidateMatrix::MAX_VALUE;
+  CandidateMatrix candidates;
+  if ( useCandidateMatrix )
+    candidates.build( m_distanceMatrix, m_weight, nonPickedGenotypes,
+		      maxNonPicked + 1, nearestDistToPicked );
+
+  // Otherwise the picks are made lazily. A gain can only shrink as picks
+  // are made, so an old gain is an upper bound. The candidates are kept
+  // ordered by bound and then by position in nonPickedGenotypes, and
+  // only the one on top is recomputed until it is exact for this pick.
+  // That one is what scanning all candidates would have found. One pass
+  // over all rows gives the first bounds.
+  set<pair<int, int> > bounds;                // ( -bound, position )
+  vector<int> bound( m_finalPopSize, 0 );
+  vector<int> boundPick( m_finalPopSize, -1 ); // pick the bound is exact for
+  if ( !useCandidateMatrix ){
+    for ( int i = 0; i <= maxNonPicked; i++ ){
+      int org = nonPickedGenotypes[i];
+      bound[org] = pickGain( getDistanceRow( org ), nonPickedGenotypes,
+			     maxNonPicked + 1, nearestDistToPicked, m_weight );
+      boundPick[org] = firstPick;
+      bounds.insert( make_pair( -bound[org], i ) );
+    }
+  }
+
   // output file
 
   ofstream out( clusterDataFile );
@@ -245,51 +681,87 @@ void TreeAnalyzer::doClusteringAnalysis( const char *clusterDataFile, int cutoff
   out << "#Average distance between organisms: " << m_aveDistance << endl;
   out << "#Cutoff pick value: " << cutoff << endl;
   out <<  "#<organism ID> <pick value>\n";
+  for ( int k = 0; k < firstPick; k++ )
+    out << m_finalPop[m_checkpoint.m_pickOrgs[k]] << " "
+	<< m_checkpoint.m_pickValues[k] << "\n";
 
   // now find best to pick
   int pick;
   int pickValue;
   int pickI;
-  int pickOrg = 0;
-  for ( pick = 0; pick < m_finalPopSize; pick++ ){ // for each possible pick
+  for ( pick = firstPick; pick < m_finalPopSize && !m_checkpoint.m_finished;
+	pick++ ){ // for each possible pick
     pickValue = 0;
     pickI = 0;
     //    cout << "[" << pick+1 << "/" << m_finalPopSize << "] ";
-    for ( int i = 0; i <= maxNonPicked; i++ ){ // for each organism
 
-      // calculate drop in distance ( = value )
-      int value = 0;
-      for ( int j = 0; j <= maxNonPicked; j++ ){
-	if ( nearestDistToPicked[nonPickedGenotypes[j]]
-	     > m_distanceMatrix[nonPickedGenotypes[i]][nonPickedGenotypes[j]] ){
-	  value += nearestDistToPicked[nonPickedGenotypes[j]]
-		   - m_distanceMatrix[nonPickedGenotypes[i]][nonPickedGenotypes[j]];
+    if ( useCandidateMatrix ){
+      for ( int i = 0; i <= maxNonPicked; i++ ){ // for each organism
+	int value = candidates.gain( nonPickedGenotypes[i] );
+	if ( value > pickValue ){
+	  pickValue = value;
+	  pickI = i;
+	  pickOrg = nonPickedGenotypes[i];
 	}
       }
-      if ( value > pickValue ){
-	pickValue = value;
+    }
+    else {
+      while ( boundPick[nonPickedGenotypes[(*bounds.begin()).second]] != pick ){
+	int i = (*bounds.begin()).second;
+	int org = nonPickedGenotypes[i];
+	bounds.erase( bounds.begin() );
+	bound[org] = pickGain( getDistanceRow( org ), nonPickedGenotypes,
+			       maxNonPicked + 1, nearestDistToPicked, m_weight );
+	boundPick[org] = pick;
+	bounds.insert( make_pair( -bound[org], i ) );
+      }
+      int i = (*bounds.begin()).second;
+      if ( bound[nonPickedGenotypes[i]] > pickValue ){
+	pickValue = bound[nonPickedGenotypes[i]];
 	pickI = i;
 	pickOrg = nonPickedGenotypes[i];
       }
-    }	
-
-    // now actually adjust distances
-    for ( int j = 0; j <= maxNonPicked; j++ ){
-      if ( nearestDistToPicked[nonPickedGenotypes[j]]
-	   > m_distanceMatrix[pickOrg][nonPickedGenotypes[j]] ){
-	nearestDistToPicked[nonPickedGenotypes[j]]
-	  = m_distanceMatrix[pickOrg][nonPickedGenotypes[j]];
+    }
+
+    // now actually adjust distances. With nothing to gain pickOrg is still
+    // the previous pick: its distances are in already, and it may have
+    // been squeezed out of the compact layout.
+    if ( pickValue > 0 && useCandidateMatrix )
+      candidates.pick( pickOrg );
+    else if ( pickValue > 0 ){
+      const int *pickRow = getDistanceRow( pickOrg );
+      for ( int j = 0; j <= maxNonPicked; j++ ){
+	if ( nearestDistToPicked[nonPickedGenotypes[j]]
+	     > pickRow[nonPickedGenotypes[j]] ){
+	  nearestDistToPicked[nonPickedGenotypes[j]]
+	    = pickRow[nonPickedGenotypes[j]];
+	}
       }
     }
 
-    // and remove picked
+    // and remove picked; the last candidate moves into its place
+    if ( !useCandidateMatrix ){
+      int last = nonPickedGenotypes[maxNonPicked];
+      bounds.erase( make_pair( -bound[nonPickedGenotypes[pickI]], pickI ) );
+      if ( pickI != maxNonPicked ){
+	bounds.erase( make_pair( -bound[last], maxNonPicked ) );
+	bounds.insert( make_pair( -bound[last], pickI ) );
+      }
+    }
     nonPickedGenotypes[pickI] = nonPickedGenotypes[maxNonPicked];
     maxNonPicked -= 1;
 
+    // picked organisms stay in the compact layout with a zero distance
+    // to the nearest pick; squeeze them out once they are half of it
+    if ( useCandidateMatrix && 2*( maxNonPicked + 1 ) < candidates.size() )
+      candidates.compact( nonPickedGenotypes, maxNonPicked + 1 );
+
     // cout << "Picked " << m_finalPop[pickOrg] << " at " <<  pickValue << "\n";
     out << m_finalPop[pickOrg] << " " <<  pickValue << "\n";
+    m_checkpoint.m_pickOrgs.push_back( pickOrg );
+    m_checkpoint.m_pickValues.push_back( pickValue );
 
-    m_picked.push_back( pickI ); // new
+    m_picked.push_back( pickOrg ); // new
 
     // 2002/11/22: adjusted so that m_picked holds at least one value
     // before: m_picked holds only those _above_ cutoff for clarity.
@@ -302,9 +774,22 @@ void TreeAnalyzer::doClusteringAnalysis( const char *clusterDataFile, int cutoff
     // we don't have to pick all organisms, just a couple
     if ( pick>=99 )
       break;
+
+    if ( checkpointDue() ){
+      if ( useCandidateMatrix )
+	for ( int j = 0; j <= maxNonPicked; j++ )
+	  nearestDistToPicked[nonPickedGenotypes[j]]
+	    = candidates.getNearest( nonPickedGenotypes[j] );
+      saveClusteringCheckpoint( nonPickedGenotypes, maxNonPicked + 1,
+				nearestDistToPicked, false );
+    }
   }
 
   out.close();
+
+  // later steps may still be interrupted, the picks are final
+  saveClusteringCheckpoint( nonPickedGenotypes, maxNonPicked + 1,
+			    nearestDistToPicked, true );
 }
 
 void TreeAnalyzer::sortData( const char *sortedDataFile )
@@ -336,33 +821,392 @@ void TreeAnalyzer::sortData( const char *sortedDataFile )
       cluster[i][1] = -1;
     }
   }
-  out << "#<genotype> <closest picked genotype> <distance>\n";
+  //    minDist = 2 * m_maxTreeDepth;
+  minDist = 2 * m_maxDistance;
+  closest = -1;
+  vector<int> repClosest( m_finalPopSize, closest );
+  vector<int> repMinDist( m_finalPopSize, minDist );
+
+  // The matrix is symmetric, so only the rows of the picked are needed.
+  // Each is fetched once and compared against every organism; the picks
+  // are visited in order, so ties go to the earlier pick as before.
+  vector<int>::iterator pickedIter;
+  for ( pickedIter = m_picked.begin(); pickedIter != m_picked.end();
+	pickedIter++ ) {
+    const int *row = getDistanceRow( *pickedIter );
+    for ( int i = 0; i < m_finalPopSize; i++ ) {
+      if ( row[i] < repMinDist[i] ) {
+	repMinDist[i] = row[i];
+	repClosest[i] = *pickedIter;
+      }
+    }
+  }
+
   for ( int i = 0; i < m_finalPopSize; i++ ) {
-    //    minDist = 2 * m_maxTreeDepth;
-    minDist = 2 * m_maxDistance;
-    closest = -1;
-    vector<int>::iterator pickedIter;
-    for ( pickedIter = m_picked.begin(); pickedIter != m_picked.end();
-	  pickedIter++ ) {
-      if ( m_distanceMatrix[i][*pickedIter] < minDist ) {
-	minDist = m_distanceMatrix[i][*pickedIter];
-	closest = *pickedIter;
+    assert ( repClosest[i] != -1 );
+    cluster[i][1] = repClosest[i];
+  }
+
+  // identical organisms share the assignment of their representative
+  out << "#<genotype> <closest picked genotype> <distance>\n";
+  for ( unsigned int k = 0; k < m_expandedPop.size(); k++ ) {
+    int i = m_expandedRep[k];
+    out << m_expandedPop[k] << " " << m_finalPop[repClosest[i]] << " "
+	<< repMinDist[i] << endl;
+  }
+
+  out.close();
+}
+
+
+
+
+
+
+
+
+
+
+
+
+// entry (i,j), i!=j, of a lower triangle stored as rows of length i
+static double &triEntry( vector<vector<double> > &d, int i, int j )
+{
+  return i > j ? d[i][j] : d[j][i];
+}
+
+static bool mergeHeightLess( const Merge &m1, const Merge &m2 )
+{
+  return m1.m_height < m2.m_height;
+}
+
+static int findRoot( vector<int> &parent, int i )
+{
+  while ( parent[i] != i ){
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+// Input merges refer to any organism inside each of the two clusters.
+// Sorts them by height and renames the clusters so that the k-th merge
+// creates cluster n+k.
+void TreeAnalyzer::labelMerges( vector<Merge> &merges ) const
+{
+  stable_sort( merges.begin(), merges.end(), mergeHeightLess );
+
+  vector<int> parent( m_finalPopSize );
+  vector<int> label( m_finalPopSize );
+  vector<int> size( m_finalPopSize, 1 );
+  for ( int i = 0; i < m_finalPopSize; i++ ){
+    parent[i] = i;
+    label[i] = i;
+  }
+
+  for ( unsigned int k = 0; k < merges.size(); k++ ){
+    int ra = findRoot( parent, merges[k].m_a );
+    int rb = findRoot( parent, merges[k].m_b );
+    assert( ra != rb );
+
+    merges[k].m_a = min( label[ra], label[rb] );
+    merges[k].m_b = max( label[ra], label[rb] );
+    merges[k].m_size = size[ra] + size[rb];
+
+    parent[ra] = rb;
+    size[rb] += size[ra];
+    label[rb] = m_finalPopSize + k;
+  }
+}
+
+
+void TreeAnalyzer::doSingleLinkageClustering()
+{
+  cout << "doing single-linkage clustering" << endl;
+
+  // pointer representation (Sibson 1973): organism i joins the cluster
+  // of pi[i] at height lambda[i]
+  vector<int> pi( m_finalPopSize );
+  vector<double> lambda( m_finalPopSize );
+  vector<double> m( m_finalPopSize );
+
+  const double inf = numeric_limits<double>::infinity();
+
+  for ( int i = 0; i < m_finalPopSize; i++ ){
+    pi[i] = i;
+    lambda[i] = inf;
+
+    const Genotype *gi = m_genebank.getGenotype( m_finalPop[i] );
+    for ( int j = 0; j < i; j++ )
+      m[j] = m_genebank.calcTreeDist( gi,
+				      m_genebank.getGenotype( m_finalPop[j] ) );
+
+    for ( int j = 0; j < i; j++ ){
+      if ( lambda[j] >= m[j] ){
+	m[pi[j]] = min( m[pi[j]], lambda[j] );
+	lambda[j] = m[j];
+	pi[j] = i;
       }
+      else
+	m[pi[j]] = min( m[pi[j]], m[j] );
+    }
+
+    for ( int j = 0; j < i; j++ ){
+      if ( lambda[j] >= lambda[pi[j]] )
+	pi[j] = i;
+    }
+  }
+
+  m_merges.clear();
+  for ( int i = 0; i < m_finalPopSize - 1; i++ ){
+    Merge merge = { i, pi[i], lambda[i], 0 };
+    m_merges.push_back( merge );
+  }
+  labelMerges( m_merges );
+}
+
+
+void TreeAnalyzer::doAverageLinkageClustering()
+{
+  cout << "doing average-linkage clustering" << endl;
+
+  int n = m_finalPopSize;
+  bool haveMatrix = static_cast<int>( m_distanceMatrix.size() ) == n;
+
+  // Lower triangle only. The matrix is not needed after sortData, so each
+  // of its rows is released as soon as it is copied; the triangle rows
+  // reuse that memory and the two are never held in full together.
+  vector<vector<double> > d( n );
+  for ( int i = 0; i < n; i++ ){
+    d[i].resize( i );
+    if ( haveMatrix ){
+      for ( int j = 0; j < i; j++ )
+	d[i][j] = m_distanceMatrix[i][j];
+      vector<int>().swap( m_distanceMatrix[i] );
+      continue;
     }
-    assert ( closest != -1 );
-    cluster[i][1] = closest;
-    out << m_finalPop[i] << " " << m_finalPop[closest] << " " << minDist << endl;
+
+    // the genebank is empty after --merge, but then the matrix is there
+    const Genotype *gi = m_genebank.getGenotype( m_finalPop[i] );
+    for ( int j = 0; j < i; j++ )
+      d[i][j] =
+	m_genebank.calcTreeDist( gi, m_genebank.getGenotype( m_finalPop[j] ) );
   }
+  m_distanceMatrix.clear();
+
+  // a cluster lives in the slot of one of its organisms
+  vector<int> size( n, 1 );
+  vector<int> chain;
+  int remaining = n;
+
+  m_merges.clear();
+  while ( remaining > 1 ){
+    if ( chain.empty() ){
+      for ( int i = 0; i < n; i++ )
+	if ( size[i] > 0 ){
+	  chain.push_back( i );
+	  break;
+	}
+    }
+
+    // grow the chain until we hit a pair of reciprocal nearest neighbors
+    int a, b;
+    while ( true ){
+      a = chain.back();
+      int prev = chain.size() > 1 ? chain[chain.size() - 2] : -1;
+      b = prev;
+      double minDist = prev >= 0 ?
+	triEntry( d, a, prev ) : numeric_limits<double>::infinity();
+      for ( int k = 0; k < n; k++ ){
+	if ( k == a || size[k] == 0 )
+	  continue;
+	double dk = triEntry( d, a, k );
+	if ( dk < minDist ){
+	  minDist = dk;
+	  b = k;
+	}
+      }
+      if ( b == prev )
+	break;
+      chain.push_back( b );
+    }
+
+    chain.pop_back();
+    chain.pop_back();
+    Merge merge = { a, b, triEntry( d, a, b ), 0 };
+    m_merges.push_back( merge );
+
+    // Lance-Williams update for UPGMA, the merged cluster lives in slot b
+    for ( int k = 0; k < n; k++ ){
+      if ( k == a || k == b || size[k] == 0 )
+	continue;
+      double &dbk = triEntry( d, b, k );
+      double dak = triEntry( d, a, k );
+      dbk = ( size[a] * dak + size[b] * dbk ) / ( size[a] + size[b] );
+    }
+    size[b] += size[a];
+    size[a] = 0;
+    remaining -= 1;
+  }
+
+  labelMerges( m_merges );
+}
+
+
+void TreeAnalyzer::writeDendrogram( const char *dendrogramFile ) const
+{
+  ofstream out( dendrogramFile );
+  if ( out.fail() ) {
+    cerr << "cannot open dendrogram file " << dendrogramFile << endl;
+    exit( -1 );
+  }
+
+  out << "#Number of organisms: " << m_finalPopSize << endl;
+  out << "#<cluster> <organism ID>\n";
+  for ( int i = 0; i < m_finalPopSize; i++ )
+    out << i << " " << m_finalPop[i] << "\n";
+  out << "#<cluster> <cluster> <height> <size>, merge k creates cluster "
+      << m_finalPopSize << "+k\n";
+  // UPGMA heights are averages; keep every digit so cuts can be exact
+  out << setprecision( 17 );
+  for ( unsigned int k = 0; k < m_merges.size(); k++ )
+    out << m_merges[k].m_a << " " << m_merges[k].m_b << " "
+	<< m_merges[k].m_height << " " << m_merges[k].m_size << "\n";
 
   out.close();
 }
 
 
+void TreeAnalyzer::calculateDistanceStatistics()
+{
+  cout << "calculating distance statistics" << endl;
 
+  // Number the final population and all of its ancestors. The index of a
+  // genotype is kept in the genotype itself while we work.
+  vector<const Genotype*> nodes;
+  for ( int i = 0; i < m_finalPopSize; i++ ){
+    const Genotype *g = m_genebank.getGenotype( m_finalPop[i] );
+    while ( g != 0 && g->getIndex() < 0 ){
+      g->setIndex( nodes.size() );
+      nodes.push_back( g );
+      g = g->getParent();
+    }
+  }
+
+  int numNodes = nodes.size();
+  vector<int> parent( numNodes, -1 );
+  vector<int> weight( numNodes, 0 );    // length of the edge to the parent
+  vector<int> children( numNodes, 0 );
+  for ( int k = 0; k < numNodes; k++ ){
+    const Genotype *p = nodes[k]->getParent();
+    if ( p != 0 ){
+      parent[k] = p->getIndex();
+      weight[k] = nodes[k]->getTreeDepth() - p->getTreeDepth();
+      children[parent[k]] += 1;
+    }
+  }
 
+  vector<long long> count( numNodes, 0 );  // organisms in the subtree
+  vector<int> top1( numNodes, -1 );        // longest path down to an organism
+  vector<int> top2( numNodes, -1 );        // second longest via another child
+  vector<map<int, long long>*> bag( numNodes, (map<int, long long>*)0 );
+  for ( int i = 0; i < m_finalPopSize; i++ ){
+    int k = m_genebank.getGenotype( m_finalPop[i] )->getIndex();
+    count[k] += 1;
+    top1[k] = 0;
+    bag[k] = new map<int, long long>;
+    (*bag[k])[nodes[k]->getTreeDepth()] += 1;
+  }
 
+  vector<int> queue;
+  for ( int k = 0; k < numNodes; k++ )
+    if ( children[k] == 0 )
+      queue.push_back( k );
 
+  // Children before parents. Every edge is used by count*(n-count) pairs,
+  // and the longest path bends at the node where its two halves meet.
+  // Pairs meeting at a node are counted into the histogram by merging
+  // the depth profiles of its subtrees, always the smaller into the
+  // larger; the cost is the product of the numbers of distinct depths.
+  long long n = m_finalPopSize;
+  long long sum = 0;
+  int maxDist = 0;
+  m_distanceHistogram.assign( 1, 0 );
+  for ( unsigned int q = 0; q < queue.size(); q++ ){
+    int k = queue[q];
+    if ( top1[k] >= 0 && top2[k] >= 0 )
+      maxDist = max( maxDist, top1[k] + top2[k] );
 
+    int p = parent[k];
+    if ( p < 0 )
+      continue;
 
+    sum += weight[k] * count[k] * ( n - count[k] );
+    count[p] += count[k];
 
+    if ( top1[k] >= 0 ){
+      int down = top1[k] + weight[k];
+      if ( down > top1[p] ){
+	top2[p] = top1[p];
+	top1[p] = down;
+      }
+      else if ( down > top2[p] )
+	top2[p] = down;
+    }
 
+    if ( bag[k] != 0 ){
+      if ( bag[p] == 0 )
+	swap( bag[p], bag[k] );
+      else {
+	if ( bag[p]->size() < bag[k]->size() )
+	  swap( bag[p], bag[k] );
+	int lcaDepth = nodes[p]->getTreeDepth();
+	map<int, long long>::const_iterator it1, it2;
+	for ( it1 = bag[k]->begin(); it1 != bag[k]->end(); it1++ )
+	  for ( it2 = bag[p]->begin(); it2 != bag[p]->end(); it2++ ){
+	    unsigned int dist = (*it1).first + (*it2).first - 2*lcaDepth;
+	    if ( dist >= m_distanceHistogram.size() )
+	      m_distanceHistogram.resize( dist + 1, 0 );
+	    m_distanceHistogram[dist] += (*it1).second * (*it2).second;
+	  }
+	for ( it1 = bag[k]->begin(); it1 != bag[k]->end(); it1++ )
+	  (*bag[p])[(*it1).first] += (*it1).second;
+	delete bag[k];
+	bag[k] = 0;
+      }
+    }
+
+    children[p] -= 1;
+    if ( children[p] == 0 )
+      queue.push_back( p );
+  }
+
+  for ( int k = 0; k < numNodes; k++ ){
+    delete bag[k];
+    nodes[k]->setIndex( -1 );
+  }
+
+  // same conventions as the matrix fill: the average runs over all n*n
+  // entries including the diagonal
+  m_maxDistance = maxDist;
+  m_aveDistance = 2.0 * sum / static_cast<double>( n*n );
+}
+
+
+void TreeAnalyzer::writeDistanceStatistics( const char *statisticsFile ) const
+{
+  ofstream out( statisticsFile );
+  if ( out.fail() ) {
+    cerr << "cannot open statistics file " << statisticsFile << endl;
+    exit( -1 );
+  }
+
+  out << "#Maximum distance between organisms: " << m_maxDistance << endl;
+  out << "#Average distance between organisms: " << m_aveDistance << endl;
+  out << "#<distance> <number of organism pairs>\n";
+  for ( unsigned int d = 0; d < m_distanceHistogram.size(); d++ )
+    if ( m_distanceHistogram[d] > 0 )
+      out << d << " " << m_distanceHistogram[d] << "\n";
+
+  out.close();
+}
@@ -1,8 +1,25 @@
 #ifndef TREE_ANALYZER_H
 #define TREE_ANALYZER_H
 
+#include <string>
+#include <time.h>
 #include <vector>
+#include "checkpoint.h"
 #include "genebank.h"
+#include "row_cache.h"
+
+enum DistanceMetric { TREE_DISTANCE, HAMMING_DISTANCE, MRCA_DISTANCE };
+
+/**
+ * One step of a dendrogram. Clusters 0..n-1 are the organisms of the
+ * final population (in load order); the k-th merge creates cluster n+k.
+ **/
+struct Merge {
+  int m_a;
+  int m_b;
+  double m_height;
+  int m_size;
+};
 
 class TreeAnalyzer {
 private:
@@ -11,22 +28,129 @@ private:
   vector<int> m_finalPop;
   vector<vector<int> > m_distanceMatrix;
   vector<int> m_picked; // new
+  vector<int> m_weight;      // organisms represented by each m_finalPop entry
+  vector<int> m_expandedPop; // ids of the whole final population
+  vector<int> m_expandedRep; // index of their representative in m_finalPop
   int m_finalPopSize;
   int m_maxTreeDepth;
   double m_aveDistance;
   int m_maxDistance;
+  bool m_genomesLoaded;
+  vector<Merge> m_merges;
+  vector<long long> m_distanceHistogram;
+  RowCache *m_rowCache;      // rows computed on demand instead of the matrix
+  DistanceMetric m_lazyMetric;
+  string m_checkpointFile;   // empty if checkpoints are off
+  int m_checkpointInterval;  // seconds
+  time_t m_lastCheckpoint;
+  CheckpointState m_checkpoint;
+
+  void labelMerges( vector<Merge> &merges ) const;
+  int calcDistance( DistanceMetric metric, int i, int j ) const;
+  void resetRepresentatives();
+  void fillDistanceMatrix( DistanceMetric metric );
+
+  bool checkpointDue() const;
+  void saveDistanceCheckpoint( int rows );
+  void saveClusteringCheckpoint( const vector<int> &nonPicked, int numNonPicked,
+				 const vector<int> &nearest, bool finished );
+
+  /**
+   * Row i of the distance matrix. Without a matrix the row is computed
+   * now and cached. The pointer is only valid until the next call.
+   **/
+  const int *getDistanceRow( int i );
   
 public:
   TreeAnalyzer();
   ~TreeAnalyzer();
   
   //  void loadData();
-  void loadData( const char *gzDetailFile, const char *gzHistoricFile);
+
+  /**
+   * Genome sequences are only kept for the final population, and only if
+   * loadGenomes is set (they are needed by the Hamming distance alone).
+   * At most numThreads threads parse at once, by default one per core.
+   **/
+  void loadData( const char *gzDetailFile, const char *gzHistoricFile,
+		 bool loadGenomes = false, int numThreads = 0 );
+
+  /**
+   * Collapses organisms with identical genomes into one weighted
+   * representative. Requires the genomes to be loaded. Clustering then
+   * runs on the representatives, and sortData lists every organism.
+   **/
+  void dedupFinalPopulation();
+
+  /**
+   * Saves the progress of the distance matrix fill and of the clustering
+   * to checkpointFile every interval seconds. With resume, an existing
+   * checkpoint of the same population and options is continued. Call
+   * after the final population is known.
+   **/
+  void enableCheckpoints( const char *checkpointFile, int interval,
+			  bool resume, DistanceMetric metric, int cutoff,
+			  bool dedup, int cacheRows );
+
+  /**
+   * Deletes the checkpoint files once the run is complete.
+   **/
+  void removeCheckpoints();
+
   void calculateDistanceMatrix();
   void calculateHammingDistanceMatrix();
   void calculateMRCADistanceMatrix();
+
+  /**
+   * Instead of filling the distance matrix, computes rows when the
+   * clustering asks for them and keeps the cacheRows most recently used.
+   * Maximum and average distance come from calculateDistanceStatistics,
+   * so only the tree distance is supported.
+   **/
+  void useDistanceRows( int cacheRows );
+
+  /**
+   * Computes shard number shard (1..numShards) of the upper triangle of
+   * the distance matrix and writes it to shardFile. The shards are
+   * balanced by number of pairs.
+   **/
+  void calculateDistanceMatrixShard( const char *shardFile, int shard,
+				     int numShards,
+				     DistanceMetric metric = TREE_DISTANCE );
+
+  /**
+   * Assembles the distance matrix and the final population from all the
+   * shards of a run, in place of loadData and calculate*DistanceMatrix.
+   **/
+  void mergeDistanceMatrixShards( const vector<string> &shardFiles );
+
+  /**
+   * Average and maximum tree distance and the histogram of pairwise tree
+   * distances, computed on the tree itself without a distance matrix.
+   **/
+  void calculateDistanceStatistics();
+  void writeDistanceStatistics( const char *statisticsFile ) const;
+
   void doClusteringAnalysis( const char *clusterDataFile, int cutoff = 1 );
   void sortData( const char *sortedDataFile );
+
+  /**
+   * Single-linkage dendrogram (SLINK). Distances are streamed from the
+   * genebank, so this needs O(n) memory and no distance matrix.
+   **/
+  void doSingleLinkageClustering();
+
+  /**
+   * Average-linkage (UPGMA) dendrogram using nearest-neighbor chains.
+   * Uses the distance matrix if it has been calculated already.
+   **/
+  void doAverageLinkageClustering();
+
+  /**
+   * Writes the merge list of the last dendrogram. Cutting it at a given
+   * height only requires replaying the merges below that height.
+   **/
+  void writeDendrogram( const char *dendrogramFile ) const;
 };
 
 #endif